@@ -0,0 +1,355 @@
+// Checks what the xmalloc interface promises on top of plain malloc and free against par_malloc:
+// xcalloc memory reads as zero however it got there, aligned blocks are aligned, and the usable size,
+// xexpand, xfree_sized and the batch calls all keep to what they say. Prints every check that fails
+// and "all ok" if none did
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "par_malloc.h"
+
+#define DECAY_MS 50		// Short, so freed runs get purged while we wait
+#define PURGE_WAIT_MS 3000	// Most we'll wait for them to be
+
+static int failures = 0;
+
+// Notes a failed check along with where it was
+#define check(cond, ...) \
+	do \
+	{ \
+		if (!(cond)) \
+		{ \
+			printf("FAIL line %d: ", __LINE__); \
+			printf(__VA_ARGS__); \
+			printf("\n"); \
+			++failures; \
+		} \
+	} while (0)
+
+// Sizes across the slab classes, the size classes, and ones big enough for a mapping of their own
+static size_t const sizes[] = {1, 8, 24, 100, 255, 256, 257, 1000, 5000, 70000, 300000, 3000000};
+#define NUM_SIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+// Whether every byte of a range is zero
+static int all_zero(void const* ptr, size_t bytes)
+{
+	unsigned char const* bytes_at = ptr;
+	for (size_t ii = 0; ii < bytes; ++ii)
+	{
+		if (bytes_at[ii] != 0)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Whether every byte of a range is the value given
+static int all_set(void const* ptr, int value, size_t bytes)
+{
+	unsigned char const* bytes_at = ptr;
+	for (size_t ii = 0; ii < bytes; ++ii)
+	{
+		if (bytes_at[ii] != (unsigned char)value)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void sleep_ms(long ms)
+{
+	struct timespec ts = {ms / 1000, ms % 1000 * 1000000};
+	nanosleep(&ts, 0);
+}
+
+///// xcalloc /////
+
+// Dirties blocks of every size, frees them and checks what xcalloc hands out next is all zero
+static void check_calloc_reuse()
+{
+	for (int round = 0; round < 4; ++round)
+	{
+		for (size_t ii = 0; ii < NUM_SIZES; ++ii)
+		{
+			void* ptrs[16];
+			for (int jj = 0; jj < 16; ++jj)
+			{
+				ptrs[jj] = xmalloc(sizes[ii]);
+				memset(ptrs[jj], 0xab, xmalloc_usable_size(ptrs[jj]));
+			}
+			for (int jj = 0; jj < 16; ++jj)
+			{
+				xfree(ptrs[jj]);
+			}
+			for (int jj = 0; jj < 16; ++jj)
+			{
+				ptrs[jj] = xcalloc(1, sizes[ii]);
+				check(ptrs[jj] && all_zero(ptrs[jj], sizes[ii]), "xcalloc(%zu) after reuse isn't zero", sizes[ii]);
+			}
+			for (int jj = 0; jj < 16; ++jj)
+			{
+				xfree(ptrs[jj]);
+			}
+		}
+	}
+	check(xcalloc(SIZE_MAX / 2, 3) == 0, "xcalloc overflowing its multiplication didn't fail");
+}
+
+// Shrinking hands a dirty tail back, which xcalloc mustn't take for clean
+static void check_calloc_shrink()
+{
+	for (size_t ii = 0; ii < NUM_SIZES; ++ii)
+	{
+		size_t const big = sizes[ii] * 4 + 4096;
+		char* ptr = xmalloc(big);
+		memset(ptr, 0xcd, big);
+		ptr = xrealloc(ptr, sizes[ii]);
+		check(ptr && all_set(ptr, 0xcd, sizes[ii]), "xrealloc shrinking to %zu lost the data", sizes[ii]);
+		void* after[8];
+		for (int jj = 0; jj < 8; ++jj)
+		{
+			after[jj] = xcalloc(1, big / 8);
+			check(after[jj] && all_zero(after[jj], big / 8), "xcalloc(%zu) after a shrink isn't zero", big / 8);
+		}
+		for (int jj = 0; jj < 8; ++jj)
+		{
+			xfree(after[jj]);
+		}
+		xfree(ptr);
+	}
+}
+
+// Frees a lot of dirty memory, waits for the collector to purge it, then checks it comes back zero
+static void check_calloc_purge()
+{
+	enum { COUNT = 64, BYTES = 40000 };
+	xmalloc_counters before;
+	xmalloc_stats(&before);
+	void* ptrs[COUNT];
+	for (int ii = 0; ii < COUNT; ++ii)
+	{
+		ptrs[ii] = xmalloc(BYTES);
+		memset(ptrs[ii], 0xef, BYTES);
+	}
+	for (int ii = 0; ii < COUNT; ++ii)
+	{
+		xfree(ptrs[ii]);
+	}
+
+	// Frees only reach the collector once a thread's cache fills, so these push them along
+	for (int ii = 0; ii < COUNT; ++ii)
+	{
+		void* churn[64];
+		for (int jj = 0; jj < 64; ++jj)
+		{
+			churn[jj] = xmalloc(3000);
+		}
+		for (int jj = 0; jj < 64; ++jj)
+		{
+			xfree(churn[jj]);
+		}
+	}
+	xmalloc_counters after = before;
+	for (long waited = 0; after.purge_calls == before.purge_calls && waited < PURGE_WAIT_MS; waited += 10)
+	{
+		sleep_ms(10);
+		xmalloc_stats(&after);
+	}
+	check(after.purge_calls > before.purge_calls, "nothing was purged after %d ms", PURGE_WAIT_MS);
+	for (int ii = 0; ii < COUNT; ++ii)
+	{
+		ptrs[ii] = xcalloc(BYTES, 1);
+		check(ptrs[ii] && all_zero(ptrs[ii], BYTES), "xcalloc(%d) after a purge isn't zero", BYTES);
+	}
+	for (int ii = 0; ii < COUNT; ++ii)
+	{
+		xfree(ptrs[ii]);
+	}
+}
+
+///// Aligned /////
+
+static void check_aligned()
+{
+	for (size_t alignment = 1; alignment <= 1 << 16; alignment *= 2)
+	{
+		for (size_t ii = 0; ii < NUM_SIZES; ++ii)
+		{
+			char* ptr = xmalloc_aligned(alignment, sizes[ii]);
+			check(ptr && (uintptr_t)ptr % alignment == 0, "xmalloc_aligned(%zu, %zu) isn't aligned",
+				alignment, sizes[ii]);
+			if (ptr == 0)
+			{
+				continue;
+			}
+			size_t const usable = xmalloc_usable_size(ptr);
+			check(usable >= sizes[ii], "xmalloc_aligned(%zu, %zu) has only %zu usable", alignment, sizes[ii], usable);
+			memset(ptr, 0x5a, usable);
+			ptr = xrealloc(ptr, sizes[ii] + 100);
+			check(ptr && all_set(ptr, 0x5a, sizes[ii]), "xrealloc of an aligned block lost the data");
+			xfree(ptr);
+		}
+	}
+	void* out = 0;
+	check(xposix_memalign(&out, 64, 100) == 0 && (uintptr_t)out % 64 == 0, "xposix_memalign(64) failed");
+	xfree(out);
+	check(xposix_memalign(&out, 24, 100) == EINVAL, "xposix_memalign took an alignment of 24");
+	check(xposix_memalign(&out, 4, 100) == EINVAL, "xposix_memalign took an alignment smaller than a pointer");
+	check(xmalloc_aligned(48, 100) == 0, "xmalloc_aligned took an alignment of 48");
+}
+
+///// Usable size, xexpand and xfree_sized /////
+
+// Blocks can be written right up to their usable size without touching their neighbours
+static void check_usable_size()
+{
+	for (size_t ii = 0; ii < NUM_SIZES; ++ii)
+	{
+		char* ptrs[8];
+		for (int jj = 0; jj < 8; ++jj)
+		{
+			ptrs[jj] = xmalloc(sizes[ii]);
+			size_t const usable = xmalloc_usable_size(ptrs[jj]);
+			check(usable >= sizes[ii], "xmalloc(%zu) has only %zu usable", sizes[ii], usable);
+			memset(ptrs[jj], jj + 1, usable);
+		}
+		for (int jj = 0; jj < 8; ++jj)
+		{
+			check(all_set(ptrs[jj], jj + 1, xmalloc_usable_size(ptrs[jj])),
+				"writing blocks of %zu up to their usable size overlapped", sizes[ii]);
+			xfree(ptrs[jj]);
+		}
+	}
+	check(xmalloc_usable_size(0) == 0, "a null pointer has a usable size");
+}
+
+static void check_expand()
+{
+	for (size_t ii = 0; ii < NUM_SIZES; ++ii)
+	{
+		char* ptr = xmalloc(sizes[ii]);
+		size_t const usable = xmalloc_usable_size(ptr);
+		memset(ptr, 0x3c, usable);
+		check(xexpand(ptr, usable) == ptr, "xexpand(%zu) to its usable size moved or failed", sizes[ii]);
+		check(xexpand(ptr, SIZE_MAX / 2) == 0, "xexpand(%zu) to something impossible didn't fail", sizes[ii]);
+
+		// Growing either happens where it is or not at all
+		void* grown = xexpand(ptr, usable * 2 + 64);
+		check(grown == 0 || grown == ptr, "xexpand(%zu) moved the block", sizes[ii]);
+		if (grown)
+		{
+			check(xmalloc_usable_size(ptr) >= usable * 2 + 64, "xexpand(%zu) grew it too little", sizes[ii]);
+		}
+		check(all_set(ptr, 0x3c, usable), "xexpand(%zu) lost the data", sizes[ii]);
+		xfree(ptr);
+	}
+}
+
+// Freeing with the size asked for or the usable size is the same as a plain free
+static void check_free_sized()
+{
+	for (int round = 0; round < 2; ++round)
+	{
+		for (size_t ii = 0; ii < NUM_SIZES; ++ii)
+		{
+			void* ptrs[16];
+			for (int jj = 0; jj < 16; ++jj)
+			{
+				ptrs[jj] = xmalloc(sizes[ii]);
+				memset(ptrs[jj], 0x77, sizes[ii]);
+			}
+			for (int jj = 0; jj < 16; ++jj)
+			{
+				xfree_sized(ptrs[jj], jj % 2 ? sizes[ii] : xmalloc_usable_size(ptrs[jj]));
+			}
+			for (int jj = 0; jj < 16; ++jj)
+			{
+				ptrs[jj] = xcalloc(sizes[ii], 1);
+				check(ptrs[jj] && all_zero(ptrs[jj], sizes[ii]), "xcalloc(%zu) after xfree_sized isn't zero",
+					sizes[ii]);
+			}
+			for (int jj = 0; jj < 16; ++jj)
+			{
+				xfree_sized(ptrs[jj], sizes[ii]);
+			}
+		}
+	}
+	xfree_sized(0, 10);
+}
+
+///// Batches /////
+
+enum { BATCH = 500 };
+
+// Fills every block with its own index and checks none of them share memory
+static void check_batch_blocks(void** ptrs, size_t count, size_t bytes)
+{
+	for (size_t ii = 0; ii < count; ++ii)
+	{
+		check(xmalloc_usable_size(ptrs[ii]) >= bytes, "xmalloc_batch(%zu) gave a block too small", bytes);
+		memset(ptrs[ii], (int)(ii % 251), bytes);
+	}
+	for (size_t ii = 0; ii < count; ++ii)
+	{
+		check(all_set(ptrs[ii], (int)(ii % 251), bytes), "xmalloc_batch(%zu) gave blocks that overlap", bytes);
+	}
+}
+
+static void* free_batch_remotely(void* ptrs)
+{
+	xfree_batch(ptrs, BATCH);
+	return 0;
+}
+
+static void check_batch()
+{
+	static void* ptrs[BATCH];
+	for (size_t ii = 0; ii < NUM_SIZES && sizes[ii] <= 70000; ++ii)
+	{
+		size_t const got = xmalloc_batch(sizes[ii], BATCH, ptrs);
+		check(got == BATCH, "xmalloc_batch(%zu) gave %zu of %d", sizes[ii], got, BATCH);
+		check_batch_blocks(ptrs, got, sizes[ii]);
+		xfree_batch(ptrs, got);
+	}
+
+	// Another thread freeing them sends them back to this one
+	size_t const got = xmalloc_batch(48, BATCH, ptrs);
+	check(got == BATCH, "xmalloc_batch(48) gave %zu of %d", got, BATCH);
+	check_batch_blocks(ptrs, got, 48);
+	pthread_t thread;
+	pthread_create(&thread, 0, free_batch_remotely, ptrs);
+	pthread_join(thread, 0);
+	check(xmalloc_batch(48, BATCH, ptrs) == BATCH, "xmalloc_batch(48) after remote frees came up short");
+	check_batch_blocks(ptrs, BATCH, 48);
+	xfree_batch(ptrs, BATCH);
+
+	check(xmalloc_batch(0, 10, ptrs) == 0 && xmalloc_batch(48, 0, ptrs) == 0, "an empty batch gave blocks");
+}
+
+int main()
+{
+	// Has to be set before the first allocation starts the collector
+	char decay[16];
+	snprintf(decay, sizeof(decay), "%d", DECAY_MS);
+	setenv("PAR_MALLOC_DECAY_MS", decay, 1);
+
+	check_calloc_reuse();
+	check_calloc_shrink();
+	check_calloc_purge();
+	check_aligned();
+	check_usable_size();
+	check_expand();
+	check_free_sized();
+	check_batch();
+	if (failures == 0)
+	{
+		printf("all ok\n");
+	}
+	return failures != 0;
+}
@@ -0,0 +1,183 @@
+// Batch benchmark, runs the list driver's allocation pattern: a list gets copied a cell at a time,
+// grown by a few dozen cells and the old one freed, over and over. With xmalloc and xfree
+// for every cell, and with the list copied and freed through xmalloc_batch and xfree_batch,
+// a few times each taking turns, and prints the spread
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "list.h"
+
+#define LISTS 256
+#define GROWTH 50		// Cells the driver adds to a list each time it copies it
+#define MAX_LENGTH 350
+#define TRIALS 7		// Runs of each, alternating which goes first
+#define BATCH 64		// Cells allocated or freed in one call
+
+// Copies a list front to back, one allocation per cell
+static cell* copy_each(cell* xs)
+{
+	cell* ys = 0;
+	cell** tail = &ys;
+	for (; xs; xs = xs->rest)
+	{
+		cell* cl = xmalloc(sizeof(cell));
+		cl->item = xs->item;
+		*tail = cl;
+		tail = &cl->rest;
+	}
+	*tail = 0;
+	return ys;
+}
+
+// Frees a list one cell at a time
+static void free_each(cell* xs)
+{
+	while (xs)
+	{
+		cell* rest = xs->rest;
+		xfree(xs);
+		xs = rest;
+	}
+}
+
+// Copies a list front to back, a batch of cells at a time
+static cell* copy_batched(cell* xs)
+{
+	cell* ys = 0;
+	cell** tail = &ys;
+	long left = count_list(xs);
+	while (left > 0)
+	{
+		cell* batch[BATCH];
+		long const nn = left < BATCH ? left : BATCH;
+		if (xmalloc_batch(sizeof(cell), nn, (void**)batch) != (size_t)nn)
+		{
+			abort();
+		}
+		for (long ii = 0; ii < nn; ++ii)
+		{
+			batch[ii]->item = xs->item;
+			*tail = batch[ii];
+			tail = &batch[ii]->rest;
+			xs = xs->rest;
+		}
+		left -= nn;
+	}
+	*tail = 0;
+	return ys;
+}
+
+// Frees a list a batch of cells at a time
+static void free_batched(cell* xs)
+{
+	cell* batch[BATCH];
+	long nn = 0;
+	while (xs)
+	{
+		batch[nn++] = xs;
+		xs = xs->rest;
+		if (nn == BATCH)
+		{
+			xfree_batch((void**)batch, nn);
+			nn = 0;
+		}
+	}
+	xfree_batch((void**)batch, nn);
+}
+
+// Copies, grows and frees every list for the rounds given, returning the seconds it took
+static double run(cell** lists, long rounds, int batched)
+{
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (long round = 0; round < rounds; ++round)
+	{
+		for (int ii = 0; ii < LISTS; ++ii)
+		{
+			cell* old = lists[ii];
+			cell* xs = batched ? copy_batched(old) : copy_each(old);
+			for (int jj = 0; jj < GROWTH; ++jj)
+			{
+				xs = cons(xs->item + 1, xs);
+			}
+			if (batched)
+			{
+				free_batched(old);
+			}
+			else
+			{
+				free_each(old);
+			}
+			// Starts over once it's as long as the driver's longest, so lists stay the lengths it sees
+			if (count_list(xs) > MAX_LENGTH)
+			{
+				if (batched)
+				{
+					free_batched(xs);
+				}
+				else
+				{
+					free_each(xs);
+				}
+				xs = cons(ii, 0);
+			}
+			lists[ii] = xs;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+// Sets every list up fresh, runs the rounds given and frees them again, returning the seconds it took
+static double trial(long rounds, int batched, long* cells)
+{
+	cell* lists[LISTS];
+	for (int ii = 0; ii < LISTS; ++ii)
+	{
+		lists[ii] = cons(ii, 0);
+	}
+	double const secs = run(lists, rounds, batched);
+	*cells = 0;
+	for (int ii = 0; ii < LISTS; ++ii)
+	{
+		*cells += count_list(lists[ii]);
+		free_list(lists[ii]);
+	}
+	return secs;
+}
+
+static int compare_secs(void const* aa, void const* bb)
+{
+	double const a = *(double const*)aa;
+	double const b = *(double const*)bb;
+	return (a > b) - (a < b);
+}
+
+int main(int argc, char* argv[])
+{
+	long const rounds = argc > 1 ? atol(argv[1]) : 200;
+	double secs[2][TRIALS];
+	long cells = 0;
+
+	// The two take turns going first, so neither always gets the slabs the other warmed up
+	for (int tt = 0; tt < TRIALS; ++tt)
+	{
+		for (int nn = 0; nn < 2; ++nn)
+		{
+			int const batched = (tt + nn) % 2;
+			secs[batched][tt] = trial(rounds, batched, &cells);
+		}
+	}
+
+	printf("%ld rounds of %d lists, %ld cells at the end, %d trials each\n", rounds, LISTS, cells, TRIALS);
+	char const* names[2] = { "per cell", "batched " };
+	for (int batched = 0; batched < 2; ++batched)
+	{
+		qsort(secs[batched], TRIALS, sizeof(double), compare_secs);
+		printf("%s: min %.3f s, median %.3f s, max %.3f s\n", names[batched],
+			secs[batched][0], secs[batched][TRIALS / 2], secs[batched][TRIALS - 1]);
+	}
+	printf("median speedup %.2fx\n", secs[0][TRIALS / 2] / secs[1][TRIALS / 2]);
+	return 0;
+}
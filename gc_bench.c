@@ -0,0 +1,127 @@
+// Times the garbage collector's sort and coalesce pass over lists of free blocks of growing length,
+// then whole passes that bring a fixed number of new frees into global heaps of growing size
+// Built against the allocator's internals, so it pulls in the whole source file
+#include "par_malloc.c"
+
+#include <stdio.h>
+
+// Blocks are 32 bytes, a third of them stay allocated so some runs coalesce and some don't
+static free_list_node* make_free_list(char* base, size_t count, unsigned int* seed)
+{
+	free_list_node** nodes = malloc(count * sizeof(free_list_node*));
+	size_t used = 0;
+	for (size_t ii = 0; ii < count; ++ii)
+	{
+		free_list_node* node = (free_list_node*)(base + ii * MIN_ALLOC_SIZE);
+		node->size = MIN_ALLOC_SIZE;
+		node->owner = 0;
+		if (ii % 3 != 2)
+		{
+			nodes[used++] = node;
+		}
+	}
+
+	// Frees come back to the collector in no particular order
+	for (size_t ii = used; ii > 1; --ii)
+	{
+		size_t const jj = rand_r(seed) % ii;
+		free_list_node* tmp = nodes[ii - 1];
+		nodes[ii - 1] = nodes[jj];
+		nodes[jj] = tmp;
+	}
+	free_list_node* head = 0;
+	for (size_t ii = 0; ii < used; ++ii)
+	{
+		nodes[ii]->next = head;
+		head = nodes[ii];
+	}
+	free(nodes);
+	return head;
+}
+
+// Splits every fresh_every-th block off a shuffled free list, what's left is the heap they join
+static free_list_node* split_fresh(free_list_node** head, size_t fresh_every)
+{
+	free_list_node* fresh = 0;
+	free_list_node** link = head;
+	size_t ii = 0;
+	while (*link)
+	{
+		free_list_node* node = *link;
+		if (++ii % fresh_every == 0)
+		{
+			*link = node->next;
+			node->next = fresh;
+			fresh = node;
+		}
+		else
+		{
+			link = &node->next;
+		}
+	}
+	return fresh;
+}
+
+// Nanoseconds between two times
+static double elapsed_ns(struct timespec const* from, struct timespec const* to)
+{
+	return (to->tv_sec - from->tv_sec) * 1e9 + (to->tv_nsec - from->tv_nsec);
+}
+
+int main(int argc, char* argv[])
+{
+	size_t const max_blocks = argc > 1 ? atol(argv[1]) : 1 << 21;
+	unsigned int seed = 1;
+	printf("%10s %14s %10s\n", "blocks", "ns/pass", "ns/block");
+	for (size_t count = 1024; count <= max_blocks; count *= 4)
+	{
+		char* base = mmap(0, count * MIN_ALLOC_SIZE, PROT_READ | PROT_WRITE,
+			MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+		int const rounds = count < 100000 ? 20 : 3;
+		double total = 0;
+		for (int ii = 0; ii < rounds; ++ii)
+		{
+			free_list_node* head = make_free_list(base, count, &seed);
+			struct timespec start, end;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			sort_free_list_by_address(head);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			total += elapsed_ns(&start, &end);
+		}
+		size_t const freed = count - count / 3;
+		printf("%10zu %14.0f %10.1f\n", freed, total / rounds, total / rounds / freed);
+		munmap(base, count * MIN_ALLOC_SIZE);
+	}
+
+	// A pass sorts only what's new, the heap it's merged with comes back out of its bins in order
+	size_t const fresh = 1024;
+	static heap_bins heap;
+	printf("\n%10s %10s %14s %10s\n", "heap", "new", "ns/pass", "ns/new");
+	for (size_t count = 16 * fresh; count <= max_blocks; count *= 4)
+	{
+		char* base = mmap(0, count * MIN_ALLOC_SIZE, PROT_READ | PROT_WRITE,
+			MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+		int const rounds = count < 100000 ? 20 : 3;
+		double total = 0;
+		size_t heaped = 0;
+		for (int ii = 0; ii < rounds; ++ii)
+		{
+			free_list_node* head = make_free_list(base, count, &seed);
+			size_t const every = (count - count / 3) / fresh;
+			free_list_node* new_frees = split_fresh(&head, every);
+			fill_heap(&heap, sort_free_list_by_address(head).head);
+			struct timespec start, end;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			merge_result deleted = merge_free_lists_by_address(sort_free_list_by_address(new_frees),
+				detach_heap(&heap));
+			fill_heap(&heap, deleted.head);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			total += elapsed_ns(&start, &end);
+			heaped = count - count / 3 - (count - count / 3) / every;
+			detach_heap(&heap);
+		}
+		printf("%10zu %10zu %14.0f %10.1f\n", heaped, fresh, total / rounds, total / rounds / fresh);
+		munmap(base, count * MIN_ALLOC_SIZE);
+	}
+	return 0;
+}
@@ -6,6 +6,7 @@
 #include "xmalloc.h"
 #include <pthread.h>
 #include <string.h>
+#include <errno.h>
 
 typedef struct memblock {
 	size_t size;
@@ -168,6 +169,23 @@ void* xmalloc(size_t _size)
 	}
 }
 
+void*
+xcalloc(size_t count,size_t _size)
+{
+	size_t size;
+	if(__builtin_mul_overflow(count,_size,&size))
+	{
+		return 0;
+	}
+	void* ret=xmalloc(size);
+	//big blocks get a fresh mapping, which is already zero
+	if(fix_size(size)<PAGE_SIZE)
+	{
+		memset(ret,0,size);
+	}
+	return ret;
+}
+
 void
 xfree(void* item)
 {
@@ -177,7 +195,9 @@ xfree(void* item)
 	//printf("size free %ld\n",size);
 	if(size>PAGE_SIZE)
 	{
-		munmap(block,size);
+		//aligned blocks can start partway into their first page
+		char* const start=(char*)((size_t)block/PAGE_SIZE*PAGE_SIZE);
+		munmap(start,size+((char*)block-start));
 	}
 	else
 	{
@@ -187,6 +207,12 @@ xfree(void* item)
 	}
 }
 
+void
+xfree_sized(void* item,size_t _size)
+{
+	xfree(item);
+}
+
 void*
 xrealloc(void* item,size_t _size)
 {
@@ -210,3 +236,114 @@ xrealloc(void* item,size_t _size)
 	}
 }
 
+void*
+xexpand(void* item,size_t _size)
+{
+	if(item==0)
+	{
+		return 0;
+	}
+	memblock* block=(memblock*)((char*)item-sizeof(size_t));
+	return block->size>=fix_size(_size)?item:0;
+}
+
+static size_t align_up(size_t xx,size_t alignment)
+{
+	return (xx+alignment-1)&~(alignment-1);
+}
+
+void*
+xmalloc_aligned(size_t alignment,size_t _size)
+{
+	if(alignment==0||(alignment&(alignment-1)))
+	{
+		return 0;
+	}
+	if(alignment<=sizeof(size_t))
+	{
+		return xmalloc(_size);
+	}
+	size_t const size=fix_size(_size);
+	if(size+alignment+MIN_ALLOC_SIZE<PAGE_SIZE)
+	{
+		//take enough to skip a free block's worth and still land on the alignment, then give the head back
+		memblock* outer=(memblock*)((char*)xmalloc(size+alignment+MIN_ALLOC_SIZE)-sizeof(size_t));
+		size_t const data=align_up((size_t)outer->data+MIN_ALLOC_SIZE,alignment);
+		memblock* block=(memblock*)(data-sizeof(size_t));
+		size_t const head_size=(char*)block-(char*)outer;
+		block->size=outer->size-head_size;
+		outer->size=head_size;
+		pthread_mutex_lock(&list_mutex);
+		insert_block_nonempty(outer);
+		pthread_mutex_unlock(&list_mutex);
+		return block->data;
+	}
+	else
+	{
+		//map a page more than needed so the block stays big enough for xfree to unmap it
+		size_t const mapped=size+alignment+PAGE_SIZE;
+		char* map=mmap(0,mapped,PROT_READ|PROT_WRITE,MAP_ANONYMOUS|MAP_PRIVATE,-1,0);
+		if(map==MAP_FAILED)
+		{
+			return 0;
+		}
+		size_t const data=align_up((size_t)map+sizeof(size_t),alignment);
+		memblock* block=(memblock*)(data-sizeof(size_t));
+		size_t const unused=(size_t)block/PAGE_SIZE*PAGE_SIZE-(size_t)map;
+		if(unused)
+		{
+			munmap(map,unused);
+		}
+		block->size=map+mapped-(char*)block;
+		return block->data;
+	}
+}
+
+int
+xposix_memalign(void** out,size_t alignment,size_t _size)
+{
+	if(alignment==0||(alignment&(alignment-1))||alignment%sizeof(void*))
+	{
+		return EINVAL;
+	}
+	void* ret=xmalloc_aligned(alignment,_size);
+	if(ret==0)
+	{
+		return ENOMEM;
+	}
+	*out=ret;
+	return 0;
+}
+
+size_t
+xmalloc_usable_size(void* item)
+{
+	if(item==0)
+	{
+		return 0;
+	}
+	memblock* block=(memblock*)((char*)item-sizeof(size_t));
+	return block->size-sizeof(size_t);
+}
+
+size_t
+xmalloc_batch(size_t _size,size_t count,void** out)
+{
+	for(size_t ii=0;ii<count;++ii)
+	{
+		out[ii]=xmalloc(_size);
+	}
+	return count;
+}
+
+void
+xfree_batch(void** items,size_t count)
+{
+	for(size_t ii=0;ii<count;++ii)
+	{
+		if(items[ii])
+		{
+			xfree(items[ii]);
+		}
+	}
+}
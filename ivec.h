@@ -18,9 +18,10 @@ make_ivec(int cap0)
     assert(cap0 > 0);
 
     ivec* xs = xmalloc(sizeof(ivec));
-    xs->cap  = cap0;
     xs->size = 0;
-    xs->data = xmalloc(xs->cap * sizeof(long));
+    xs->data = xmalloc(cap0 * sizeof(long));
+    // The allocator may have rounded up, so use whatever room it gave us
+    xs->cap  = xmalloc_usable_size(xs->data) / sizeof(long);
     return xs;
 }
 
@@ -28,8 +29,8 @@ static
 void
 free_ivec(ivec* xs)
 {
-    xfree(xs->data);
-    xfree(xs);
+    xfree_sized(xs->data, xs->cap * sizeof(long));
+    xfree_sized(xs, sizeof(ivec));
 }
 
 static
@@ -37,8 +38,8 @@ void
 ivec_push(ivec* xs, long item)
 {
     if (xs->size >= xs->cap) {
-        xs->cap *= 2;
-        xs->data = xrealloc(xs->data, xs->cap * sizeof(long));
+        xs->data = xrealloc(xs->data, 2 * xs->cap * sizeof(long));
+        xs->cap  = xmalloc_usable_size(xs->data) / sizeof(long);
     }
 
     xs->data[xs->size] = item;
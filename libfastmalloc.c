@@ -0,0 +1,220 @@
+// The C and C++ allocation functions on top of par_malloc, built as libfastmalloc.so so any
+// dynamically linked program can use it with LD_PRELOAD=./libfastmalloc.so
+// Built against the allocator's internals, so it pulls in the whole source file
+#include "par_malloc.c"
+
+#include <malloc.h>
+
+// Unlike xmalloc, malloc has to hand out a unique pointer even for nothing, and set errno when it can't
+void* malloc(size_t bytes)
+{
+	void* ret = xmalloc(bytes ? bytes : 1);
+	if (unlikely(ret == 0))
+	{
+		errno = ENOMEM;
+	}
+	return ret;
+}
+
+void free(void* ptr)
+{
+	xfree(ptr);
+}
+
+void* calloc(size_t count, size_t size)
+{
+	void* ret = count && size ? xcalloc(count, size) : xcalloc(1, 1);
+	if (unlikely(ret == 0))
+	{
+		errno = ENOMEM;
+	}
+	return ret;
+}
+
+// Like glibc, asking for nothing frees the block
+void* realloc(void* ptr, size_t bytes)
+{
+	if (ptr && bytes == 0)
+	{
+		xfree(ptr);
+		return 0;
+	}
+	void* ret = ptr ? xrealloc(ptr, bytes) : malloc(bytes);
+	if (unlikely(ret == 0))
+	{
+		errno = ENOMEM;
+	}
+	return ret;
+}
+
+void* reallocarray(void* ptr, size_t count, size_t size)
+{
+	size_t bytes;
+	if (unlikely(__builtin_mul_overflow(count, size, &bytes)))
+	{
+		errno = ENOMEM;
+		return 0;
+	}
+	return realloc(ptr, bytes);
+}
+
+///// Aligned /////
+
+// Leaves errno alone and returns the error instead, as it's specified to
+int posix_memalign(void** out, size_t alignment, size_t bytes)
+{
+	return xposix_memalign(out, alignment, bytes ? bytes : 1);
+}
+
+void* aligned_alloc(size_t alignment, size_t bytes)
+{
+	void* ret = xmalloc_aligned(alignment, bytes ? bytes : 1);
+	if (unlikely(ret == 0) && power_of_two(alignment))
+	{
+		errno = ENOMEM;
+	}
+	return ret;
+}
+
+// Older and more forgiving, glibc rounds an alignment that isn't a power of two up to one
+void* memalign(size_t alignment, size_t bytes)
+{
+	if (alignment > SIZE_MAX / 2 + 1)
+	{
+		errno = EINVAL;
+		return 0;
+	}
+	size_t rounded = 1;
+	while (rounded < alignment)
+	{
+		rounded *= 2;
+	}
+	return aligned_alloc(rounded, bytes);
+}
+
+void* valloc(size_t bytes)
+{
+	return aligned_alloc(PAGE_SIZE, bytes);
+}
+
+void* pvalloc(size_t bytes)
+{
+	if (unlikely(bytes > SIZE_MAX - PAGE_SIZE))
+	{
+		errno = ENOMEM;
+		return 0;
+	}
+	return aligned_alloc(PAGE_SIZE, div_up(bytes ? bytes : 1, PAGE_SIZE) * PAGE_SIZE);
+}
+
+size_t malloc_usable_size(void* ptr)
+{
+	return xmalloc_usable_size(ptr);
+}
+
+///// C++ /////
+
+// operator new has to throw std::bad_alloc when it fails. libstdc++'s helper for that is only
+// there in C++ programs, everything else can't have called operator new in the first place
+extern void _ZSt17__throw_bad_allocv(void) __attribute__((weak, noreturn));
+
+// What every throwing operator new does
+static void* new_or_throw(size_t alignment, size_t bytes)
+{
+	void* ret = xmalloc_aligned(alignment, bytes ? bytes : 1);
+	if (unlikely(ret == 0))
+	{
+		if (_ZSt17__throw_bad_allocv)
+		{
+			_ZSt17__throw_bad_allocv();
+		}
+		abort();
+	}
+	return ret;
+}
+
+// operator new(size_t), new[](size_t) and the nothrow versions
+void* _Znwm(size_t bytes)
+{
+	return new_or_throw(16, bytes);
+}
+void* _Znam(size_t bytes)
+{
+	return new_or_throw(16, bytes);
+}
+void* _ZnwmRKSt9nothrow_t(size_t bytes, void const* tag)
+{
+	return malloc(bytes);
+}
+void* _ZnamRKSt9nothrow_t(size_t bytes, void const* tag)
+{
+	return malloc(bytes);
+}
+
+// The C++17 overaligned versions, std::align_val_t is a size_t underneath
+void* _ZnwmSt11align_val_t(size_t bytes, size_t alignment)
+{
+	return new_or_throw(alignment, bytes);
+}
+void* _ZnamSt11align_val_t(size_t bytes, size_t alignment)
+{
+	return new_or_throw(alignment, bytes);
+}
+void* _ZnwmSt11align_val_tRKSt9nothrow_t(size_t bytes, size_t alignment, void const* tag)
+{
+	return xmalloc_aligned(alignment, bytes ? bytes : 1);
+}
+void* _ZnamSt11align_val_tRKSt9nothrow_t(size_t bytes, size_t alignment, void const* tag)
+{
+	return xmalloc_aligned(alignment, bytes ? bytes : 1);
+}
+
+// Every operator delete and delete[] just frees, the sized ones let big blocks skip the slab lookup
+void _ZdlPv(void* ptr)
+{
+	xfree(ptr);
+}
+void _ZdaPv(void* ptr)
+{
+	xfree(ptr);
+}
+void _ZdlPvm(void* ptr, size_t bytes)
+{
+	xfree_sized(ptr, bytes);
+}
+void _ZdaPvm(void* ptr, size_t bytes)
+{
+	xfree_sized(ptr, bytes);
+}
+void _ZdlPvRKSt9nothrow_t(void* ptr, void const* tag)
+{
+	xfree(ptr);
+}
+void _ZdaPvRKSt9nothrow_t(void* ptr, void const* tag)
+{
+	xfree(ptr);
+}
+void _ZdlPvSt11align_val_t(void* ptr, size_t alignment)
+{
+	xfree(ptr);
+}
+void _ZdaPvSt11align_val_t(void* ptr, size_t alignment)
+{
+	xfree(ptr);
+}
+void _ZdlPvmSt11align_val_t(void* ptr, size_t bytes, size_t alignment)
+{
+	xfree_sized(ptr, bytes);
+}
+void _ZdaPvmSt11align_val_t(void* ptr, size_t bytes, size_t alignment)
+{
+	xfree_sized(ptr, bytes);
+}
+void _ZdlPvSt11align_val_tRKSt9nothrow_t(void* ptr, size_t alignment, void const* tag)
+{
+	xfree(ptr);
+}
+void _ZdaPvSt11align_val_tRKSt9nothrow_t(void* ptr, size_t alignment, void const* tag)
+{
+	xfree(ptr);
+}
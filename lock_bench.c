@@ -0,0 +1,99 @@
+// Contention benchmark, runs more threads than there are cores through the allocator's shared paths:
+// big blocks through the large mapping cache, and medium blocks allocated in bursts and freed
+// by the next thread over, so caches keep overflowing to the collector and refilling from the global heap
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "par_malloc.h"
+
+#define BURST 256
+
+typedef struct worker {
+	pthread_t thread;
+	long rounds;
+	void* handoff[BURST];		// Filled by this thread, freed by the next one
+	pthread_mutex_t mutex;
+	int full;
+	struct worker* next;
+} worker;
+
+static void* work(void* arg)
+{
+	worker* self = arg;
+	unsigned int seed = (unsigned int)(size_t)self;
+	for (long round = 0; round < self->rounds; ++round)
+	{
+		void* big = xmalloc(300000 + rand_r(&seed) % 100000);
+		memset(big, 1, 64);
+
+		// Frees whatever the previous thread handed us, then hands the next one a new burst
+		pthread_mutex_lock(&self->mutex);
+		if (self->full)
+		{
+			for (int ii = 0; ii < BURST; ++ii)
+			{
+				xfree(self->handoff[ii]);
+			}
+			self->full = 0;
+		}
+		pthread_mutex_unlock(&self->mutex);
+
+		worker* next = self->next;
+		pthread_mutex_lock(&next->mutex);
+		if (!next->full)
+		{
+			for (int ii = 0; ii < BURST; ++ii)
+			{
+				next->handoff[ii] = xmalloc(512 + rand_r(&seed) % 8192);
+			}
+			next->full = 1;
+		}
+		pthread_mutex_unlock(&next->mutex);
+		xfree(big);
+	}
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	long const cores = sysconf(_SC_NPROCESSORS_ONLN);
+	int const threads = argc > 1 ? atoi(argv[1]) : 8 * cores;
+	long const rounds = argc > 2 ? atol(argv[2]) : 20000 / threads * 8;
+	worker* workers = calloc(threads, sizeof(worker));
+	for (int ii = 0; ii < threads; ++ii)
+	{
+		workers[ii].rounds = rounds;
+		workers[ii].next = &workers[(ii + 1) % threads];
+		pthread_mutex_init(&workers[ii].mutex, 0);
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int ii = 0; ii < threads; ++ii)
+	{
+		pthread_create(&workers[ii].thread, 0, work, &workers[ii]);
+	}
+	for (int ii = 0; ii < threads; ++ii)
+	{
+		pthread_join(workers[ii].thread, 0);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	for (int ii = 0; ii < threads; ++ii)
+	{
+		for (int jj = 0; workers[ii].full && jj < BURST; ++jj)
+		{
+			xfree(workers[ii].handoff[jj]);
+		}
+	}
+
+	double const secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%d threads on %ld cores: %.3f s, %.0f rounds/s\n", threads, cores, secs, threads * rounds / secs);
+	xmalloc_counters stats;
+	xmalloc_stats(&stats);
+	printf("lock spins %zu, sleeps %zu\n", stats.lock_spins, stats.lock_sleeps);
+	return 0;
+}
@@ -0,0 +1,42 @@
+#ifndef PAR_MALLOC_H
+#define PAR_MALLOC_H
+
+// What only par_malloc has on top of the xmalloc interface
+
+#include "xmalloc.h"
+
+// Counts of what the allocator has been doing, summed over every thread there's been
+// Maps count every mmap and every part of the arena committed, unmaps every munmap,
+// remapping counts as a map and adds what it grew or shrank by to the bytes
+typedef struct xmalloc_counters {
+	size_t cache_hits;			// Allocations served from a thread's cache
+	size_t slab_hits;			// Small allocations served from a thread's slabs
+	size_t percpu_hits;			// Small allocations served from a CPU's cache
+	size_t bump_allocs;			// Allocations carved from a thread's bump region
+	size_t global_heap_hits;	// Allocations served from the global heap
+	size_t large_allocs;		// Allocations given a mapping of their own
+	size_t remote_frees;		// Frees sent back to the thread that handed the block out
+	size_t cache_flushes;		// Times a thread sent part of its cache to the collector
+	size_t mmap_calls;
+	size_t mmap_bytes;
+	size_t munmap_calls;
+	size_t munmap_bytes;
+	size_t gc_passes;			// Passes the collector made
+	size_t blocks_coalesced;	// Free blocks the collector merged into the one before them
+	size_t lock_spins;			// Pauses taken waiting for a lock
+	size_t lock_sleeps;			// Times a thread had to sleep on a lock
+	size_t purge_calls;			// Ranges of idle free pages given back to the system
+	size_t purged_bytes;
+} xmalloc_counters;
+
+// Sums up the counters, meant to be called now and then rather than on a hot path
+void xmalloc_stats(xmalloc_counters* out);
+// Writes the counters to a file descriptor as one name and value per line, or as a JSON object
+void xmalloc_stats_print(int fd, int json);
+
+// Writes the allocations the heap profiler sampled that are still live as folded stacks, one call site
+// per line with its frames outermost first and the bytes it's estimated to hold. PAR_MALLOC_PROFILE
+// set to the mean bytes between samples turns the profiler on, without it there's nothing to write
+void xmalloc_profile_dump(int fd);
+
+#endif
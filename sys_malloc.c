@@ -2,6 +2,7 @@
 
 #include <stdlib.h>
 #include <unistd.h>
+#include <malloc.h>
 
 #include "xmalloc.h"
 
@@ -12,15 +13,74 @@ xmalloc(size_t bytes)
     return malloc(bytes);
 }
 
+void*
+xcalloc(size_t count, size_t size)
+{
+    return calloc(count, size);
+}
+
 void
 xfree(void* ptr)
 {
     free(ptr);
 }
 
+void
+xfree_sized(void* ptr, size_t bytes)
+{
+    free(ptr);
+}
+
 void*
 xrealloc(void* prev, size_t bytes)
 {
     return realloc(prev, bytes);
 }
 
+void*
+xexpand(void* ptr, size_t bytes)
+{
+    return (ptr && malloc_usable_size(ptr) >= bytes) ? ptr : 0;
+}
+
+void*
+xmalloc_aligned(size_t alignment, size_t bytes)
+{
+    void* ret = 0;
+    if (alignment < sizeof(void*) && alignment && !(alignment & (alignment - 1))) {
+        alignment = sizeof(void*);
+    }
+    return posix_memalign(&ret, alignment, bytes) ? 0 : ret;
+}
+
+int
+xposix_memalign(void** out, size_t alignment, size_t bytes)
+{
+    return posix_memalign(out, alignment, bytes);
+}
+
+size_t
+xmalloc_usable_size(void* ptr)
+{
+    return ptr ? malloc_usable_size(ptr) : 0;
+}
+
+size_t
+xmalloc_batch(size_t bytes, size_t count, void** out)
+{
+    for (size_t ii = 0; ii < count; ++ii) {
+        out[ii] = malloc(bytes);
+        if (out[ii] == 0) {
+            return ii;
+        }
+    }
+    return count;
+}
+
+void
+xfree_batch(void** ptrs, size_t count)
+{
+    for (size_t ii = 0; ii < count; ++ii) {
+        free(ptrs[ii]);
+    }
+}
@@ -4,7 +4,7 @@ use warnings FATAL => 'all';
 use POSIX ":sys_wait_h";
 
 use Time::HiRes qw(time);
-use Test::Simple tests => 13;
+use Test::Simple tests => 14;
 
 sub get_time {
     my $data = `cat time.tmp | grep ^real`;
@@ -65,6 +65,9 @@ my $pl_ok = $par_l =~ /at 871: 178 steps/;
 ok($pl_ok, "list-par 1k");
 ok($pl_ok && $t_pl < $t_sl, "list-par beat system time");
 
+my $api = run_prog("api-check", "");
+ok($api =~ /^all ok$/m, "par api checks");
+
 sub clang_check {
     my $errs = `clang-check *.c -- 2>&1`;
     chomp $errs;
@@ -4,7 +4,15 @@
 #include <stddef.h>
 
 void* xmalloc(size_t bytes);
+void* xcalloc(size_t count, size_t size);
 void  xfree(void* ptr);
+void  xfree_sized(void* ptr, size_t bytes);
 void* xrealloc(void* prev, size_t bytes);
+void* xexpand(void* ptr, size_t bytes);
+void* xmalloc_aligned(size_t alignment, size_t bytes);
+int   xposix_memalign(void** out, size_t alignment, size_t bytes);
+size_t xmalloc_usable_size(void* ptr);
+size_t xmalloc_batch(size_t bytes, size_t count, void** out);
+void  xfree_batch(void** ptrs, size_t count);
 
 #endif